@@ -0,0 +1,373 @@
+/*
+? BENCHMARK
+Drives the engine directly, without the REPL, and reports throughput and
+latency of its hot paths. start.c is compiled in whole with its main left
+out, so every internal function is reachable :
+
+    gcc -O2 bench.c my_getline.c -o bench -pthread -lm
+    ./bench --rows 1000000 --dist zipf --wal
+
+Phases, each timed per operation :
+  insert  --rows rows, ids 1..rows in the order --dist gives
+  lookup  --lookups point selects of existing ids
+  scan    --scans full selects, the rows formatted into /dev/null
+  count   --scans filtered count(*) scans that never materialise a row
+--dist seq inserts and looks up in id order, random in a shuffled order
+with uniform lookups, zipf in a shuffled order with lookups following a
+Zipfian distribution (--theta, popular ids scattered over the key space).
+The pager options of the REPL (--cache-pages, --mmap, --wal, --pax,
+--io-uring, --direct-io, --compress, --verify, --threads) are accepted as
+well. After the run the database is closed and its size divided by the
+row count gives bytes per row.
+
+The run builds its database from scratch. By default that is a fresh
+temporary file (mkstemp, under $TMPDIR or /tmp), removed with its WAL at
+the end. --file keeps the database for a look afterwards, but refuses to
+start over an existing file or WAL unless --overwrite is given as well.
+*/
+#define DB_NO_MAIN
+#include "start.c"
+
+#include <math.h>
+#include <sys/stat.h>
+
+typedef enum
+{
+    DIST_SEQUENTIAL,
+    DIST_RANDOM,
+    DIST_ZIPF
+} Distribution;
+
+typedef struct
+{
+    double theta;
+    double zeta_n;
+    double alpha;
+    double eta;
+    uint32_t n;
+} Zipf;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+// xorshift64*, fixed seed so runs are comparable
+static uint64_t bench_random()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+static double bench_random_unit()
+{
+    return (bench_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Gray et al., "Quickly generating billion-record synthetic databases"
+static void zipf_init(Zipf *zipf, uint32_t n, double theta)
+{
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->zeta_n = 0;
+    for (uint32_t i = 1; i <= n; i++)
+    {
+        zipf->zeta_n += 1.0 / pow(i, theta);
+    }
+    double zeta_2 = 1.0 + 1.0 / pow(2, theta);
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta_2 / zipf->zeta_n);
+}
+
+// A rank in [0, n), rank 0 the most popular
+static uint32_t zipf_next(Zipf *zipf)
+{
+    double u = bench_random_unit();
+    double uz = u * zipf->zeta_n;
+    if (uz < 1.0)
+    {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, zipf->theta))
+    {
+        return 1;
+    }
+    uint32_t rank = (uint32_t)(zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+    return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t first = *(const uint64_t *)a;
+    uint64_t second = *(const uint64_t *)b;
+    return first < second ? -1 : first > second;
+}
+
+// Prints one result line. latencies (ns, one per operation) get sorted
+static void bench_report(const char *phase, uint64_t *latencies, uint32_t count, uint64_t total_ns,
+                         uint64_t items, const char *unit)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    qsort(latencies, count, sizeof(uint64_t), compare_u64);
+    double seconds = total_ns / 1e9;
+    printf("%-7s %10u ops %12.0f ops/s %12.0f %s/s   p50 %9.2f us   p99 %9.2f us\n", phase, count,
+           count / seconds, items / seconds, unit, latencies[count / 2] / 1e3,
+           latencies[(uint64_t)count * 99 / 100] / 1e3);
+}
+
+// Runs a compiled statement like the REPL does, returning its latency
+static uint64_t bench_execute(Statement *statement, Table *table)
+{
+    uint64_t start = monotonic_ns();
+    execute_statement(statement, table);
+    pager_statement_done(table->pager);
+    arena_reset(&table->arena);
+    return monotonic_ns() - start;
+}
+
+static uint32_t *bench_key_order(uint32_t rows, Distribution distribution)
+{
+    uint32_t *keys = malloc(sizeof(uint32_t) * rows);
+    for (uint32_t i = 0; i < rows; i++)
+    {
+        keys[i] = i + 1;
+    }
+    for (uint32_t i = rows - 1; distribution != DIST_SEQUENTIAL && i > 0; i--)
+    {
+        uint32_t j = bench_random() % (i + 1);
+        uint32_t swap = keys[i];
+        keys[i] = keys[j];
+        keys[j] = swap;
+    }
+    return keys;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename = NULL;
+    bool overwrite = false;
+    uint32_t rows = 100000;
+    uint32_t lookups = 100000;
+    uint32_t scans = 5;
+    double theta = 0.99;
+    Distribution distribution = DIST_RANDOM;
+    uint32_t scan_threads = 1;
+    PagerConfig config = {.mode = PAGER_MODE_CACHE,
+                          .cache_frames = PAGER_DEFAULT_CACHE_FRAMES,
+                          .wal = false,
+                          .io_uring = false,
+                          .direct_io = false,
+                          .wal_sync_ms = WAL_DEFAULT_SYNC_MS,
+                          .wal_sync_bytes = WAL_DEFAULT_SYNC_BYTES,
+                          .pax = false,
+                          .compress = false,
+                          .verify = VERIFY_READS};
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--file") == 0 && has_value)
+        {
+            filename = argv[++i];
+        }
+        else if (strcmp(argv[i], "--overwrite") == 0)
+        {
+            overwrite = true;
+        }
+        else if (strcmp(argv[i], "--rows") == 0 && has_value)
+        {
+            rows = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--lookups") == 0 && has_value)
+        {
+            lookups = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--scans") == 0 && has_value)
+        {
+            scans = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--theta") == 0 && has_value)
+        {
+            theta = strtod(argv[++i], NULL);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && has_value)
+        {
+            rng_state = strtoull(argv[++i], NULL, 10) | 1;
+        }
+        else if (strcmp(argv[i], "--dist") == 0 && has_value)
+        {
+            i++;
+            distribution = strcmp(argv[i], "seq") == 0    ? DIST_SEQUENTIAL
+                           : strcmp(argv[i], "zipf") == 0 ? DIST_ZIPF
+                                                          : DIST_RANDOM;
+        }
+        else if (strcmp(argv[i], "--cache-pages") == 0 && has_value)
+        {
+            config.cache_frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && has_value)
+        {
+            scan_threads = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--mmap") == 0)
+        {
+            config.mode = PAGER_MODE_MMAP;
+        }
+        else if (strcmp(argv[i], "--wal") == 0)
+        {
+            config.wal = true;
+        }
+        else if (strcmp(argv[i], "--pax") == 0)
+        {
+            config.pax = true;
+        }
+        else if (strcmp(argv[i], "--io-uring") == 0)
+        {
+            config.io_uring = true;
+        }
+        else if (strcmp(argv[i], "--direct-io") == 0)
+        {
+            config.direct_io = true;
+        }
+        else if (strcmp(argv[i], "--compress") == 0)
+        {
+            config.compress = true;
+        }
+        else if (strcmp(argv[i], "--verify") == 0 && has_value)
+        {
+            config.verify = parse_page_verify(argv[++i]);
+        }
+        else
+        {
+            printf("Unknown option '%s'\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (rows == 0 || theta <= 0 || theta == 1.0 || scan_threads < 1 || scan_threads > PARALLEL_SCAN_MAX_THREADS)
+    {
+        printf("Need --rows > 0, --theta > 0 and not 1, --threads 1 to %d.\n", PARALLEL_SCAN_MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+
+    char temp_filename[4096];
+    bool temporary = filename == NULL;
+    if (temporary)
+    {
+        const char *temp_dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+        snprintf(temp_filename, sizeof(temp_filename), "%s/bench-XXXXXX", temp_dir);
+        int fd = mkstemp(temp_filename);
+        if (fd == -1)
+        {
+            printf("Unable to create a file in %s: %s\n", temp_dir, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        // Left empty, so db_open takes it for a new database
+        close(fd);
+        filename = temp_filename;
+    }
+    char wal_filename[sizeof(temp_filename) + sizeof("-wal")];
+    snprintf(wal_filename, sizeof(wal_filename), "%s-wal", filename);
+    if (!temporary)
+    {
+        if (!overwrite && (access(filename, F_OK) == 0 || access(wal_filename, F_OK) == 0))
+        {
+            printf("%s or its WAL already exists, pass --overwrite to replace it.\n", filename);
+            exit(EXIT_FAILURE);
+        }
+        unlink(filename);
+        unlink(wal_filename);
+    }
+    scan_kernels_init();
+    Table *table = db_open(filename, &config);
+    table->scan_threads = scan_threads;
+    // Rows are still formatted, just not kept
+    table->output.fd = open("/dev/null", O_WRONLY);
+    StatementCache *cache = new_statement_cache();
+
+    uint32_t max_ops = rows > lookups ? rows : lookups;
+    uint64_t *latencies = malloc(sizeof(uint64_t) * (max_ops > scans ? max_ops : scans));
+    uint32_t *keys = bench_key_order(rows, distribution);
+
+    Statement insert;
+    statement_compile(cache, "insert ? ? ?", strlen("insert ? ? ?"), &insert);
+    uint64_t phase_start = monotonic_ns();
+    for (uint32_t i = 0; i < rows; i++)
+    {
+        Statement statement = insert;
+        char username[COLUMN_USERNAME_SIZE];
+        char email[COLUMN_EMAIL_SIZE];
+        int username_length = snprintf(username, sizeof(username), "user%u", keys[i]);
+        int email_length = snprintf(email, sizeof(email), "user%u@example.com", keys[i]);
+        statement_bind_uint32(&statement, statement.placeholders[0], keys[i]);
+        statement_bind_text(&statement, statement.placeholders[1], username, username_length);
+        statement_bind_text(&statement, statement.placeholders[2], email, email_length);
+        latencies[i] = bench_execute(&statement, table);
+    }
+    bench_report("insert", latencies, rows, monotonic_ns() - phase_start, rows, "rows");
+
+    Zipf zipf;
+    if (distribution == DIST_ZIPF)
+    {
+        zipf_init(&zipf, rows, theta);
+    }
+    Statement lookup;
+    statement_compile(cache, "select where id = ?", strlen("select where id = ?"), &lookup);
+    phase_start = monotonic_ns();
+    for (uint32_t i = 0; i < lookups; i++)
+    {
+        uint32_t key;
+        switch (distribution)
+        {
+        case (DIST_SEQUENTIAL):
+            key = i % rows + 1;
+            break;
+        case (DIST_ZIPF):
+            // Scatter the ranks so the hot ids are not all in one leaf
+            key = (uint32_t)((zipf_next(&zipf) * 2654435761ull) % rows) + 1;
+            break;
+        default:
+            key = bench_random() % rows + 1;
+            break;
+        }
+        Statement statement = lookup;
+        statement_bind_uint32(&statement, statement.placeholders[0], key);
+        latencies[i] = bench_execute(&statement, table);
+    }
+    bench_report("lookup", latencies, lookups, monotonic_ns() - phase_start, lookups, "rows");
+
+    const char *scan_sql[] = {"select", "select count(*) where username = 'nobody'"};
+    const char *scan_phase[] = {"scan", "count"};
+    for (uint32_t kind = 0; kind < 2; kind++)
+    {
+        Statement scan;
+        statement_compile(cache, scan_sql[kind], strlen(scan_sql[kind]), &scan);
+        phase_start = monotonic_ns();
+        for (uint32_t i = 0; i < scans; i++)
+        {
+            latencies[i] = bench_execute(&scan, table);
+        }
+        bench_report(scan_phase[kind], latencies, scans, monotonic_ns() - phase_start, (uint64_t)scans * rows,
+                     "rows");
+    }
+    sink_flush(&table->output);
+    close(table->output.fd);
+    table->output.fd = STDOUT_FILENO;
+
+    uint32_t num_rows = table->num_rows;
+    db_close(table);
+    struct stat file_stat;
+    if (stat(filename, &file_stat) == 0)
+    {
+        printf("size    %10lld bytes %10.1f bytes/row\n", (long long)file_stat.st_size,
+               (double)file_stat.st_size / num_rows);
+    }
+    if (temporary)
+    {
+        unlink(filename);
+        unlink(wal_filename);
+    }
+    free(latencies);
+    free(keys);
+    return 0;
+}
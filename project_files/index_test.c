@@ -0,0 +1,287 @@
+/*
+? INDEX TESTS
+Checks the secondary indexes against the rows they index. Like bench.c it
+compiles start.c in whole with its main left out, runs statements through
+the engine and then walks the index itself with index_scan :
+
+    gcc -O2 index_test.c my_getline.c -o index_test -pthread
+    ./index_test
+
+Emails are made long (over 60 bytes) so a few hundred rows already split
+the index leaves and then its internal nodes. Updates and deletes take the
+old entries out again, and an update also puts the new one in. Each case
+prints ok or what went wrong, and the exit status is the number of failed
+cases.
+*/
+#define DB_NO_MAIN
+#include "start.c"
+
+#include <stdarg.h>
+
+#define TEST_LONG_PART "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx" // 60 bytes
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+// xorshift64*, fixed seed so failures repeat
+static uint64_t test_random()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+typedef struct
+{
+    char filename[4096];
+    Table *table;
+    StatementCache *cache;
+} TestDb;
+
+static void test_db_open(TestDb *db)
+{
+    const char *temp_dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    snprintf(db->filename, sizeof(db->filename), "%s/index-test-XXXXXX", temp_dir);
+    int fd = mkstemp(db->filename);
+    if (fd == -1)
+    {
+        printf("Unable to create a file in %s: %s\n", temp_dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    PagerConfig config = {.mode = PAGER_MODE_CACHE,
+                          .cache_frames = PAGER_DEFAULT_CACHE_FRAMES,
+                          .wal = false,
+                          .io_uring = false,
+                          .direct_io = false,
+                          .wal_sync_ms = WAL_DEFAULT_SYNC_MS,
+                          .wal_sync_bytes = WAL_DEFAULT_SYNC_BYTES,
+                          .pax = false,
+                          .compress = false,
+                          .verify = VERIFY_READS};
+    db->table = db_open(db->filename, &config);
+    db->table->output.fd = open("/dev/null", O_WRONLY);
+    db->cache = new_statement_cache();
+}
+
+static void test_db_close(TestDb *db)
+{
+    sink_flush(&db->table->output);
+    close(db->table->output.fd);
+    db->table->output.fd = STDOUT_FILENO;
+    db_close(db->table);
+    unlink(db->filename);
+}
+
+// Runs one statement like the REPL does
+static void test_run(TestDb *db, const char *format, ...)
+{
+    char sql[1024];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(sql, sizeof(sql), format, args);
+    va_end(args);
+    Statement statement;
+    if (statement_compile(db->cache, sql, length, &statement) != PREPARE_SUCCESS)
+    {
+        printf("Could not prepare '%s'.\n", sql);
+        exit(EXIT_FAILURE);
+    }
+    execute_statement(&statement, db->table);
+    pager_statement_done(db->table->pager);
+    arena_reset(&db->table->arena);
+}
+
+static void test_email(char *email, uint32_t id, uint32_t version)
+{
+    sprintf(email, "e%05u" TEST_LONG_PART "v%u@m", id, version);
+}
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t last_id;
+} TestVisits;
+
+static void test_visit(Table *table, uint32_t id, void *context)
+{
+    (void)table;
+    TestVisits *visits = context;
+    visits->count++;
+    visits->last_id = id;
+}
+
+static TestVisits test_lookup(TestDb *db, const char *value, bool prefix)
+{
+    TestVisits visits = {0, 0};
+    index_scan(db->table, COLUMN_EMAIL, value, strlen(value), prefix, test_visit, &visits);
+    return visits;
+}
+
+// Every row of ids[0..count) is found under its email, once and with its
+// own id, and a prefix scan over all emails sees exactly count entries
+static bool test_check_index(TestDb *db, const uint32_t *ids, const uint32_t *versions, uint32_t count)
+{
+    char email[COLUMN_EMAIL_SIZE + 1];
+    for (uint32_t i = 0; i < count; i++)
+    {
+        test_email(email, ids[i], versions[i]);
+        TestVisits visits = test_lookup(db, email, false);
+        if (visits.count != 1 || visits.last_id != ids[i])
+        {
+            printf("  %s : %u entries, last id %u, want id %u\n", email, visits.count, visits.last_id, ids[i]);
+            return false;
+        }
+    }
+    TestVisits all = test_lookup(db, "e", true);
+    if (all.count != count)
+    {
+        printf("  prefix scan saw %u entries, want %u\n", all.count, count);
+        return false;
+    }
+    return true;
+}
+
+static void test_shuffle(uint32_t *ids, uint32_t count)
+{
+    for (uint32_t i = count - 1; i > 0; i--)
+    {
+        uint32_t j = test_random() % (i + 1);
+        uint32_t swap = ids[i];
+        ids[i] = ids[j];
+        ids[j] = swap;
+    }
+}
+
+// Long keys inserted in order, then shuffled, grow the index past its first
+// internal split : each lookup must take the child that holds its entry
+static bool test_insert_lookup(uint32_t rows, bool shuffled)
+{
+    TestDb db;
+    test_db_open(&db);
+    test_run(&db, "create index on email");
+    uint32_t *ids = malloc(rows * sizeof(uint32_t));
+    uint32_t *versions = calloc(rows, sizeof(uint32_t));
+    for (uint32_t i = 0; i < rows; i++)
+    {
+        ids[i] = i + 1;
+    }
+    if (shuffled)
+    {
+        test_shuffle(ids, rows);
+    }
+    char email[COLUMN_EMAIL_SIZE + 1];
+    for (uint32_t i = 0; i < rows; i++)
+    {
+        test_email(email, ids[i], 0);
+        test_run(&db, "insert %u u%u %s", ids[i], ids[i], email);
+    }
+    bool ok = test_check_index(&db, ids, versions, rows);
+    free(ids);
+    free(versions);
+    test_db_close(&db);
+    return ok;
+}
+
+// Nothing is left under an email a row no longer has
+static bool test_check_gone(TestDb *db, uint32_t id, uint32_t version)
+{
+    char email[COLUMN_EMAIL_SIZE + 1];
+    test_email(email, id, version);
+    TestVisits visits = test_lookup(db, email, false);
+    if (visits.count != 0)
+    {
+        printf("  %s : still %u entries, last id %u\n", email, visits.count, visits.last_id);
+        return false;
+    }
+    return true;
+}
+
+// Long keys inserted in order, then every other row gets a new email (some
+// twice) and every third row is deleted, both in shuffled order
+static bool test_update_delete(uint32_t rows)
+{
+    TestDb db;
+    test_db_open(&db);
+    test_run(&db, "create index on email");
+    uint32_t *ids = malloc(rows * sizeof(uint32_t));
+    uint32_t *versions = calloc(rows + 1, sizeof(uint32_t));
+    bool *deleted = calloc(rows + 1, sizeof(bool));
+    for (uint32_t i = 0; i < rows; i++)
+    {
+        ids[i] = i + 1;
+    }
+    char email[COLUMN_EMAIL_SIZE + 1];
+    for (uint32_t i = 0; i < rows; i++)
+    {
+        test_email(email, ids[i], 0);
+        test_run(&db, "insert %u u%u %s", ids[i], ids[i], email);
+    }
+
+    bool ok = true;
+    test_shuffle(ids, rows);
+    for (uint32_t pass = 0; pass < 2; pass++)
+    {
+        for (uint32_t i = 0; i < rows; i++)
+        {
+            uint32_t id = ids[i];
+            if (id % 2 == 0 && (pass == 0 || id % 3 == 1))
+            {
+                test_email(email, id, ++versions[id]);
+                test_run(&db, "update u%u %s where id = %u", id, email, id);
+                ok = ok && test_check_gone(&db, id, versions[id] - 1);
+            }
+        }
+    }
+    test_shuffle(ids, rows);
+    for (uint32_t i = 0; i < rows; i++)
+    {
+        uint32_t id = ids[i];
+        if (id % 3 == 0)
+        {
+            test_run(&db, "delete where id = %u", id);
+            deleted[id] = true;
+            ok = ok && test_check_gone(&db, id, versions[id]);
+        }
+    }
+
+    uint32_t live = 0;
+    uint32_t *live_versions = malloc(rows * sizeof(uint32_t));
+    for (uint32_t id = 1; id <= rows; id++)
+    {
+        if (!deleted[id])
+        {
+            live_versions[live] = versions[id];
+            ids[live++] = id;
+        }
+    }
+    ok = ok && test_check_index(&db, ids, live_versions, live);
+    free(live_versions);
+    free(ids);
+    free(versions);
+    free(deleted);
+    test_db_close(&db);
+    return ok;
+}
+
+int main()
+{
+    scan_kernels_init();
+    struct
+    {
+        const char *name;
+        bool ok;
+    } cases[] = {
+        {"insert 299 long keys in order", test_insert_lookup(299, false)},
+        {"insert 5000 long keys in order", test_insert_lookup(5000, false)},
+        {"insert 5000 long keys shuffled", test_insert_lookup(5000, true)},
+        {"update and delete 3000 long keys", test_update_delete(3000)},
+    };
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        printf("%-40s %s\n", cases[i].name, cases[i].ok ? "ok" : "FAILED");
+        failed += !cases[i].ok;
+    }
+    return failed;
+}
@@ -5,82 +5,162 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <unistd.h>
+#include <poll.h>
+
+#include "my_getline.h"
+
+#define LINE_READER_BLOCK_SIZE (64 * 1024)
 
 /**
- * my_getline() – read an entire line from `stream`, allocate or grow *lineptr as needed.
- *
- * @param lineptr     pointer to your buffer pointer (can be NULL initially)
- * @param n           pointer to your buffer size (can be 0 initially)
- * @param stream      input stream (e.g. stdin)
- * @return            number of characters read (including the '\n'), or -1 on EOF/error
+ * line_reader_open() – wrap `fd` in a reader with one LINE_READER_BLOCK_SIZE buffer.
  *
- * Usage:
- *   char *line = NULL;
- *   size_t len = 0;
- *   ssize_t r = my_getline(&line, &len, stdin);
- *   if (r > 0) {
- *     // line contains the input (with trailing '\n'), len is its capacity
- *   }
- *   free(line);
+ * @param fd          file descriptor to read from (e.g. STDIN_FILENO)
+ * @return            the reader, or NULL if the buffer could not be allocated
  */
-ssize_t my_getline(char **lineptr, size_t *n, FILE *stream)
+LineReader *line_reader_open(int fd)
 {
-    if (lineptr == NULL || n == NULL || stream == NULL)
+    LineReader *reader = malloc(sizeof(LineReader));
+    if (reader == NULL)
     {
-        errno = EINVAL;
-        return -1;
+        return NULL;
     }
+    reader->fd = fd;
+    reader->capacity = LINE_READER_BLOCK_SIZE;
+    reader->buffer = malloc(reader->capacity);
+    if (reader->buffer == NULL)
+    {
+        free(reader);
+        return NULL;
+    }
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = false;
+    return reader;
+}
 
-    size_t pos = 0;
-    int c;
-
-    /* If buffer is NULL or size is 0, allocate an initial chunk */
-    if (*lineptr == NULL || *n == 0)
+/* Make room after `end` : slide the unread bytes to the front, and only
+   grow the buffer when a single line already fills all of it */
+static bool line_reader_make_room(LineReader *reader)
+{
+    if (reader->start > 0)
     {
-        *n = 128;
-        *lineptr = malloc(*n);
-        if (*lineptr == NULL)
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end + 1 >= reader->capacity)
+    {
+        size_t new_capacity = reader->capacity * 2;
+        char *new_buffer = realloc(reader->buffer, new_capacity);
+        if (new_buffer == NULL)
         {
-            return -1;
+            return false;
         }
+        reader->buffer = new_buffer;
+        reader->capacity = new_capacity;
     }
+    return true;
+}
 
+/**
+ * line_reader_next() – return the next line, without copying it.
+ *
+ * Data is pulled from the descriptor with read(2) a block at a time and the
+ * newline is found with memchr, so there is no per-byte call.
+ *
+ * @param reader      reader from line_reader_open()
+ * @param line        set to the start of the line inside the reader's buffer.
+ *                    The trailing '\n' is replaced by '\0'. The view stays
+ *                    valid until the next call
+ * @return            length of the line (without the '\n'), or -1 on EOF/error
+ *
+ * Usage:
+ *   LineReader *reader = line_reader_open(STDIN_FILENO);
+ *   char *line;
+ *   ssize_t length;
+ *   while ((length = line_reader_next(reader, &line)) >= 0) {
+ *     // line[0..length) is the input, line[length] == '\0'
+ *   }
+ *   line_reader_close(reader);
+ */
+ssize_t line_reader_next(LineReader *reader, char **line)
+{
+    size_t scanned = reader->start;
     while (true)
     {
-        c = fgetc(stream);
-        if (c == EOF)
+        char *newline = memchr(reader->buffer + scanned, '\n', reader->end - scanned);
+        if (newline != NULL)
+        {
+            *line = reader->buffer + reader->start;
+            *newline = '\0';
+            ssize_t length = newline - *line;
+            reader->start = newline - reader->buffer + 1;
+            return length;
+        }
+
+        if (reader->eof)
         {
-            if (pos == 0)
+            if (reader->start == reader->end)
             {
-                return -1; // no data read, propagate EOF
+                return -1; // no data left, propagate EOF
             }
-            break; // some data read; break and return it
+            /* Last line has no '\n', the spare byte after it holds the NUL */
+            *line = reader->buffer + reader->start;
+            ssize_t length = reader->end - reader->start;
+            (*line)[length] = '\0';
+            reader->start = reader->end;
+            return length;
         }
 
-        /* Store character */
-        (*lineptr)[pos++] = (char)c;
+        if (reader->end + 1 >= reader->capacity && !line_reader_make_room(reader))
+        {
+            return -1; // realloc failed
+        }
+        scanned = reader->end; // everything before `end` holds no '\n'
 
-        /* If buffer too small, grow it */
-        if (pos + 1 >= *n)
+        ssize_t bytes_read = read(reader->fd, reader->buffer + reader->end,
+                                  reader->capacity - reader->end - 1);
+        if (bytes_read < 0)
         {
-            size_t new_size = *n * 2;
-            char *new_ptr = realloc(*lineptr, new_size);
-            if (new_ptr == NULL)
+            if (errno == EINTR)
             {
-                return -1; // realloc failed
+                continue;
             }
-            *lineptr = new_ptr;
-            *n = new_size;
+            return -1;
         }
-
-        /* Stop on newline and include it */
-        if (c == '\n')
+        if (bytes_read == 0)
         {
-            break;
+            reader->eof = true;
         }
+        reader->end += bytes_read;
+    }
+}
+
+/**
+ * line_reader_wait() – wait until line_reader_next() has something to return.
+ *
+ * @param reader      reader from line_reader_open()
+ * @param timeout_ms  longest wait, -1 waits forever
+ * @return            true when a whole line is buffered, the descriptor is
+ *                    readable or at EOF, false when the timeout ran out
+ */
+bool line_reader_wait(LineReader *reader, int timeout_ms)
+{
+    if (reader->eof || memchr(reader->buffer + reader->start, '\n', reader->end - reader->start) != NULL)
+    {
+        return true;
     }
+    struct pollfd poll_fd = {.fd = reader->fd, .events = POLLIN};
+    int ready;
+    do
+    {
+        ready = poll(&poll_fd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    return ready != 0; // on error let line_reader_next report it
+}
 
-    /* Null-terminate and return length */
-    (*lineptr)[pos] = '\0';
-    return (ssize_t)pos;
+void line_reader_close(LineReader *reader)
+{
+    free(reader->buffer);
+    free(reader);
 }
@@ -3,9 +3,25 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <sys/types.h> // for ssize_t on Linux; on Windows may need <BaseTsd.h>
 
-ssize_t my_getline(char **lineptr, size_t *n, FILE *stream);
+// Block-buffered line reader over a file descriptor. Lines are handed out
+// as views into the reader's own buffer, which is reused across calls
+typedef struct
+{
+    int fd;
+    char *buffer;
+    size_t capacity;
+    size_t start; // first byte not yet handed out
+    size_t end;   // one past the last byte read from fd
+    bool eof;
+} LineReader;
+
+LineReader *line_reader_open(int fd);
+ssize_t line_reader_next(LineReader *reader, char **line);
+bool line_reader_wait(LineReader *reader, int timeout_ms);
+void line_reader_close(LineReader *reader);
 
 #endif